@@ -24,8 +24,10 @@ typedef enum {
 
 /* Infalliable, will panic on error */
 void backend_initialize();
-/* Run inside a while loop, returns true if a loop continues */
+/* Run inside a while loop, handles every pending event, returns true if the user asked to quit */
 bool backend_loop();
+/* Shows the current frame, call once per loop after the instructions have run */
+void backend_present();
 /* Infalliable, will panic on error */
 void backend_destroy();
 
@@ -38,4 +40,5 @@ void backend_toggle_beep(bool beep);
 
 bool backend_is_pressed(Chip8Key key);
 
+/* Handles events while it waits, may return early on a key press (see the SDL backend) */
 void backend_delay(uint32_t ms);
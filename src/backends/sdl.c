@@ -2,6 +2,8 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_audio.h>
@@ -10,6 +12,8 @@
 #include "SDL2/SDL_video.h"
 
 #include "panic.h"
+#include "perf.h"
+#include "phosphor.h"
 
 typedef struct {
     SDL_Window* window;
@@ -24,9 +28,33 @@ typedef struct {
     uint16_t scale;
 
     SDL_Texture* texture;
+    SDL_Texture* phosphor_texture;
 } Screen;
 
-SDL_AudioDeviceID g_audio_device;
+/* Opened on the first beep, 0 until then */
+SDL_AudioDeviceID g_audio_device = 0;
+
+/* Set from the hud_font option in meson_options.txt */
+#ifndef HUD_FONT_PATH
+#error "HUD_FONT_PATH is not defined, build with meson or pass -DHUD_FONT_PATH=..."
+#endif
+#define HUD_FONT_SIZE 12
+#define HUD_FIRST_GLYPH ' '
+#define HUD_LAST_GLYPH '~'
+#define HUD_GLYPH_COUNT (HUD_LAST_GLYPH - HUD_FIRST_GLYPH + 1)
+#define HUD_LINES 5
+
+/* Performance overlay, toggled with F2.
+ * Every printable ASCII glyph is rasterised once into `atlas`,
+ * text is then drawn by copying rects out of it. */
+typedef struct {
+    bool enabled;
+
+    SDL_Texture* atlas;
+    SDL_Rect glyphs[HUD_GLYPH_COUNT];
+} Hud;
+
+Hud g_hud = { 0 };
 
 Screen g_backend_screen = { 0 };
 
@@ -51,8 +79,25 @@ SDL_KeyCode g_default_keys[] = {
 
 bool g_key_states[16] = { false };
 
+/* When a key went down, and when the program first read it as pressed.
+ * Both are 0 while there is nothing to measure. */
+typedef struct {
+    uint64_t pressed;
+    uint64_t observed;
+} KeyLatency;
+
+KeyLatency g_key_latency[16] = { 0 };
+
+/* Toggled with F3, see backend_delay() */
+bool g_wake_on_input = false;
+
+bool g_quit_requested = false;
+
 uint8_t g_pixel_map[64*32/8] = { 0 };
 
+/* Toggled with F1, see phosphor.h */
+bool g_phosphor_enabled = false;
+
 #define WINDOW_WIDTH 320
 #define WINDOW_HEIGHT 240
 
@@ -71,8 +116,7 @@ void backend_audio_callback(void* userdata, uint8_t* stream, int len)
 
 void backend_initialize()
 {
-	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0) panic("Couldn't initialize SDL: %s", SDL_GetError());
-    if (TTF_Init() < 0)               panic("Couldn't initialize TTF: %s", SDL_GetError());
+	if (SDL_Init(SDL_INIT_VIDEO) < 0) panic("Couldn't initialize SDL: %s", SDL_GetError());
 
 	if (SDL_CreateWindowAndRenderer(WINDOW_WIDTH,
                                     WINDOW_HEIGHT, 
@@ -90,9 +134,20 @@ void backend_initialize()
     g_backend_screen.scale = MIN(((WINDOW_WIDTH - g_backend_screen.border_width) / 64), ((WINDOW_HEIGHT - g_backend_screen.border_height) / 32));
 #undef MIN
 
+    g_backend_screen.phosphor_texture = SDL_CreateTexture(g_backend_screen.renderer,
+                                                          SDL_PIXELFORMAT_ARGB8888,
+                                                          SDL_TEXTUREACCESS_STREAMING,
+                                                          PHOSPHOR_WIDTH,
+                                                          PHOSPHOR_HEIGHT);
+    if (!g_backend_screen.phosphor_texture) panic("Couldn't create the phosphor texture: %s", SDL_GetError());
+
     backend_clear_screen();
+}
+
+void backend_open_audio()
+{
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0) panic("Couldn't initialize SDL audio: %s", SDL_GetError());
 
-    // Initilaize Audio
     SDL_AudioSpec audio_spec;
     SDL_zero(audio_spec);
 
@@ -143,47 +198,215 @@ void backend_handle_screenevent(SDL_Event e)
     backend_redraw();
 }
 
-void backend_render()
+void backend_render_phosphor()
 {
+    void* pixels;
+    int pitch;
+
+    if (SDL_LockTexture(g_backend_screen.phosphor_texture, NULL, &pixels, &pitch) < 0) panic("Couldn't lock the phosphor texture: %s", SDL_GetError());
+    phosphor_update(g_pixel_map, pixels, pitch);
+    SDL_UnlockTexture(g_backend_screen.phosphor_texture);
+
+    SDL_Rect rect;
+    rect.x = g_backend_screen.border_width;
+    rect.y = g_backend_screen.border_height;
+    rect.w = 64 * g_backend_screen.scale;
+    rect.h = 32 * g_backend_screen.scale;
+
+    SDL_SetRenderDrawColor(g_backend_screen.renderer, 0, 0, 0, 255);
+    SDL_RenderClear(g_backend_screen.renderer);
+    SDL_RenderCopy(g_backend_screen.renderer, g_backend_screen.phosphor_texture, NULL, &rect);
+}
+
+/* Returns false if the font could not be loaded, the HUD stays off then */
+bool backend_load_hud()
+{
+    if (!TTF_WasInit() && TTF_Init() < 0) {
+        fprintf(stderr, "Couldn't initialize TTF: %s\n", TTF_GetError());
+        return false;
+    }
+
+    const char* path = getenv("CHIP8_HUD_FONT");
+    if (!path) path = HUD_FONT_PATH;
+
+    TTF_Font* font = TTF_OpenFont(path, HUD_FONT_SIZE);
+    if (!font) {
+        fprintf(stderr, "Couldn't load the HUD font %s: %s\n", path, TTF_GetError());
+        return false;
+    }
+
+    /* Without kerning every glyph starts exactly at the sum of the previous advances */
+    TTF_SetFontKerning(font, 0);
+
+    char charset[HUD_GLYPH_COUNT + 1];
+    int x = 0;
+    for (int i=0; i<HUD_GLYPH_COUNT; i++) {
+        int advance = 0;
+        charset[i] = HUD_FIRST_GLYPH + i;
+        TTF_GlyphMetrics(font, charset[i], NULL, NULL, NULL, NULL, &advance);
+
+        g_hud.glyphs[i].x = x;
+        g_hud.glyphs[i].y = 0;
+        g_hud.glyphs[i].w = advance;
+        g_hud.glyphs[i].h = TTF_FontHeight(font);
+        x += advance;
+    }
+    charset[HUD_GLYPH_COUNT] = '\0';
+
+    SDL_Color white = { 255, 255, 255, 255 };
+    SDL_Surface* surface = TTF_RenderText_Blended(font, charset, white);
+    TTF_CloseFont(font);
+    if (!surface) panic("Couldn't render the HUD glyphs: %s", TTF_GetError());
+
+    g_hud.atlas = SDL_CreateTextureFromSurface(g_backend_screen.renderer, surface);
+    SDL_FreeSurface(surface);
+    if (!g_hud.atlas) panic("Couldn't create the HUD glyph atlas: %s", SDL_GetError());
+
+    return true;
+}
+
+/* Returns the width of the text, only measures it if `measure_only` is set */
+int backend_draw_hud_text(int x, int y, const char* text, bool measure_only)
+{
+    SDL_Rect rect = { x, y, 0, 0 };
+
+    for (; *text; text++) {
+        if (*text < HUD_FIRST_GLYPH || *text > HUD_LAST_GLYPH) continue;
+
+        SDL_Rect* glyph = &g_hud.glyphs[*text - HUD_FIRST_GLYPH];
+        rect.w = glyph->w;
+        rect.h = glyph->h;
+        if (!measure_only) SDL_RenderCopy(g_backend_screen.renderer, g_hud.atlas, glyph, &rect);
+        rect.x += glyph->w;
+    }
+
+    return rect.x - x;
+}
+
+void backend_render_hud()
+{
+    const PerfSnapshot* perf = perf_snapshot();
+    char lines[HUD_LINES][64];
+
+    snprintf(lines[0], sizeof(lines[0]), "IPS  %.0f", perf->instructions_per_second);
+    snprintf(lines[1], sizeof(lines[1]), "FPS  %.1f", perf->frames_per_second);
+    snprintf(lines[2], sizeof(lines[2]), "frame p50/95/99 %.1f/%.1f/%.1f ms", perf->frame_p50, perf->frame_p95, perf->frame_p99);
+    snprintf(lines[3], sizeof(lines[3]), "emu %.1f%%  present %.1f%%", perf->section_share[PERF_EMULATION] * 100, perf->section_share[PERF_PRESENTATION] * 100);
+    snprintf(lines[4], sizeof(lines[4]), "input p50/95 %s%.0f/%s%.0f ms%s",
+             perf->latency_p50[PERF_LATENCY_PHOTON] >= PERF_LATENCY_OPEN_MS ? ">=" : "", perf->latency_p50[PERF_LATENCY_PHOTON],
+             perf->latency_p95[PERF_LATENCY_PHOTON] >= PERF_LATENCY_OPEN_MS ? ">=" : "", perf->latency_p95[PERF_LATENCY_PHOTON],
+             g_wake_on_input ? " (wake)" : "");
+
+    int line_height = g_hud.glyphs[0].h;
+    int width = 0;
+    for (int i=0; i<HUD_LINES; i++) {
+        int line_width = backend_draw_hud_text(0, 0, lines[i], true);
+        if (line_width > width) width = line_width;
+    }
+
+    SDL_Rect background = { 0, 0, width + 4, HUD_LINES * line_height + 4 };
+    SDL_SetRenderDrawColor(g_backend_screen.renderer, 0, 0, 0, 255);
+    SDL_RenderFillRect(g_backend_screen.renderer, &background);
+
+    for (int i=0; i<HUD_LINES; i++) backend_draw_hud_text(2, 2 + i*line_height, lines[i], false);
+}
+
+void backend_present()
+{
+    if (g_phosphor_enabled) backend_render_phosphor();
+    if (g_hud.enabled) backend_render_hud();
+
     SDL_SetRenderDrawColor(g_backend_screen.renderer, 0, 0, 0, 255);
     SDL_RenderCopy(g_backend_screen.renderer, g_backend_screen.texture, NULL, NULL);
 	SDL_RenderPresent(g_backend_screen.renderer);
+
+    uint64_t now = perf_now();
+    for (int i=0; i<16; i++) {
+        if (!g_key_latency[i].observed) continue;
+
+        perf_record_latency(PERF_LATENCY_OBSERVE, g_key_latency[i].observed - g_key_latency[i].pressed);
+        perf_record_latency(PERF_LATENCY_PHOTON, now - g_key_latency[i].pressed);
+        g_key_latency[i].pressed = 0;
+        g_key_latency[i].observed = 0;
+    }
 }
 
 void backend_handle_keyup(SDL_Event e)
 {
-    for (int i=0; i<sizeof(g_default_keys); i++) {
+    for (int i=0; i<16; i++) {
         if (e.key.keysym.sym == g_default_keys[i]) g_key_states[i] = false;
     }
 }
 
-void backend_handle_keydown(SDL_Event e)
+void backend_toggle_phosphor()
+{
+    g_phosphor_enabled = !g_phosphor_enabled;
+    phosphor_reset();
+
+    if (!g_phosphor_enabled) backend_redraw();
+}
+
+void backend_toggle_hud()
+{
+    if (!g_hud.atlas && !backend_load_hud()) return;
+
+    g_hud.enabled = !g_hud.enabled;
+
+    if (!g_hud.enabled) backend_redraw();
+}
+
+/* Returns true if a CHIP-8 key went down */
+bool backend_handle_keydown(SDL_Event e)
 {
-    for (int i=0; i<sizeof(g_default_keys); i++) {
-        if (e.key.keysym.sym == g_default_keys[i]) g_key_states[i] = true;
+    bool pressed = false;
+
+    if (e.key.keysym.sym == SDLK_F1 && !e.key.repeat) { backend_toggle_phosphor(); return false; }
+    if (e.key.keysym.sym == SDLK_F2 && !e.key.repeat) { backend_toggle_hud(); return false; }
+    if (e.key.keysym.sym == SDLK_F3 && !e.key.repeat) { g_wake_on_input = !g_wake_on_input; return false; }
+
+    for (int i=0; i<16; i++) {
+        if (e.key.keysym.sym != g_default_keys[i]) continue;
+
+        /* Events are handled as soon as SDL pumps them, see backend_delay() */
+        if (!e.key.repeat) {
+            g_key_latency[i].pressed = perf_now();
+            g_key_latency[i].observed = 0;
+            pressed = true;
+        }
+        g_key_states[i] = true;
     }
+
+    return pressed;
 }
 
-bool backend_loop()
+/* Returns true if a CHIP-8 key went down */
+bool backend_handle_event(SDL_Event event)
 {
-    SDL_Event event;
-    SDL_PollEvent(&event);
-    if      (event.type == SDL_QUIT)        return true;
+    if      (event.type == SDL_QUIT)        g_quit_requested = true;
     else if (event.type == SDL_WINDOWEVENT) backend_handle_screenevent(event);
     else if (event.type == SDL_KEYUP)       backend_handle_keyup(event);
-    else if (event.type == SDL_KEYDOWN)     backend_handle_keydown(event);
-
-    backend_render();
+    else if (event.type == SDL_KEYDOWN)     return backend_handle_keydown(event);
 
     return false;
 }
 
+bool backend_loop()
+{
+    SDL_Event event;
+    while (SDL_PollEvent(&event)) backend_handle_event(event);
+
+    return g_quit_requested;
+}
+
 void backend_destroy()
 {
+    SDL_DestroyTexture(g_backend_screen.phosphor_texture);
+    if (g_hud.atlas) SDL_DestroyTexture(g_hud.atlas);
 	SDL_DestroyRenderer(g_backend_screen.renderer);
 	SDL_DestroyWindow(g_backend_screen.window);
 
-    SDL_CloseAudioDevice(g_audio_device);
+    if (g_audio_device) SDL_CloseAudioDevice(g_audio_device);
+    if (TTF_WasInit()) TTF_Quit();
 
     SDL_Quit();
 }
@@ -197,6 +420,8 @@ uint8_t** backend_get_pixel_map()
  * returns the current value of the pixel that is changed. */
 bool backend_flip_pixel(uint8_t x, uint8_t y)
 {
+    API_ABUSE_WHEN(x >= 64 || y >= 32);
+
     /* get the pixel index */
     int pixel = y*64+x;
     int index = pixel/8;
@@ -207,6 +432,9 @@ bool backend_flip_pixel(uint8_t x, uint8_t y)
     bool set = newval > g_pixel_map[index];
     g_pixel_map[index] = newval;
 
+    /* The phosphor filter repaints the whole screen from g_pixel_map every frame */
+    if (g_phosphor_enabled) return !set;
+
     SDL_SetRenderTarget(g_backend_screen.renderer, g_backend_screen.texture);
 
     SDL_Rect rect = { x, y, g_backend_screen.scale, g_backend_screen.scale };
@@ -223,12 +451,21 @@ bool backend_flip_pixel(uint8_t x, uint8_t y)
 
 void backend_toggle_beep(bool beep)
 {
+    /* Audio is brought up the first time the ROM beeps */
+    if (!g_audio_device) {
+        if (!beep) return;
+        backend_open_audio();
+    }
+
     SDL_PauseAudioDevice(g_audio_device, !beep);
 }
 
 bool backend_is_pressed(Chip8Key key)
 {
     if (key > 15) panic("No such key: %d", key);
+
+    if (g_key_states[key] && g_key_latency[key].pressed && !g_key_latency[key].observed) g_key_latency[key].observed = perf_now();
+
     return g_key_states[key];
 }
 
@@ -242,7 +479,20 @@ void backend_clear_screen()
     for (int i=0; i<64*32/8; i++) g_pixel_map[i] = 0;
 }
 
+/* Sleeps on the event queue instead of SDL_Delay(), so a key pressed during the
+ * wait is handled (and timestamped) as it arrives rather than at the next
+ * backend_loop(). With wake on input (F3) a CHIP-8 key press also ends the wait
+ * early, the ROM sees it right away at the cost of a shorter frame. */
 void backend_delay(uint32_t ms) 
 {
-    SDL_Delay(ms);
+    uint64_t deadline = perf_now() + (uint64_t) ms * 1000000;
+    SDL_Event event;
+
+    while (!g_quit_requested) {
+        uint64_t now = perf_now();
+        if (now >= deadline) return;
+
+        if (!SDL_WaitEventTimeout(&event, (int) ((deadline - now + 999999) / 1000000))) continue;
+        if (backend_handle_event(event) && g_wake_on_input) return;
+    }
 }
@@ -5,6 +5,7 @@
 #include "machine.h"
 #include "panic.h"
 #include "backend.h"
+#include "perf.h"
 
 bool onquit()
 {
@@ -16,8 +17,8 @@ void load_rom(char** argv) {
     FILE* rom_file = fopen(argv[1], "rb");
     if (rom_file == NULL) panic("File %s could not be read: %s", argv[1], strerror(errno));
 
-    uint8_t rom[4096-0x200] = { 0 };
-    fread(rom, 4096-0x200, 1, rom_file);
+    uint8_t rom[MACHINE_MEMORY_SIZE-0x200] = { 0 };
+    fread(rom, MACHINE_MEMORY_SIZE-0x200, 1, rom_file);
     fclose(rom_file);
 
     machine_load_rom(rom);
@@ -33,10 +34,37 @@ int main(int argc, char** argv) {
     set_self_destruct_handler(onquit);
     backend_initialize();
 
-    while(!backend_loop()) {
-        machine_run_loop();
+    Trap trap = { TRAP_NONE, 0, 0 };
+
+    for (;;) {
+        perf_begin(PERF_PRESENTATION);
+        bool quit = backend_loop();
+        perf_end(PERF_PRESENTATION);
+        if (quit) break;
+
+        /* A trapped ROM is stopped, the window stays up until the user quits */
+        if (trap.kind == TRAP_NONE) {
+            perf_begin(PERF_EMULATION);
+            trap = machine_run_loop();
+            perf_end(PERF_EMULATION);
+            perf_count_instructions(1);
+
+            if (trap.kind != TRAP_NONE) {
+                fprintf(stderr, "The ROM stopped on %s (opcode %#06x at %#05x)\n", machine_trap_name(trap.kind), trap.opcode, trap.program_counter);
+                backend_toggle_beep(false);
+            }
+        }
+
+        perf_begin(PERF_PRESENTATION);
+        backend_present();
+        perf_end(PERF_PRESENTATION);
+
         backend_delay(6);
+        perf_end_frame();
     }
 
-    return !onquit();
+    perf_print_latency(stderr);
+
+    if (!onquit()) return 1;
+    return trap.kind != TRAP_NONE;
 }
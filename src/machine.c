@@ -35,14 +35,34 @@ void machine_load_rom(uint8_t* buffer)
     memcpy(g_machine.memory, g_font, sizeof(g_font));
 
     g_machine.program_counter = 0x200;
-    memcpy(g_machine.memory+0x200, buffer, 4096-0x200);
+    memcpy(g_machine.memory+0x200, buffer, MACHINE_MEMORY_SIZE-0x200);
 
     srand(time(NULL));
 }
 
-void machine_run_loop()
+const char* machine_trap_name(TrapKind kind)
 {
-     uint16_t opcode = g_machine.memory[g_machine.program_counter] << 8 | g_machine.memory[g_machine.program_counter+1];
+    switch (kind) {
+        case TRAP_NONE:                 return "no trap";
+        case TRAP_INVALID_OPCODE:       return "invalid instruction";
+        case TRAP_INVALID_KEY:          return "invalid key";
+        case TRAP_STACK_OVERFLOW:       return "stack overflow";
+        case TRAP_STACK_UNDERFLOW:      return "stack underflow";
+        case TRAP_MEMORY_OUT_OF_BOUNDS: return "memory access out of bounds";
+    }
+
+    programming_error("No such trap: %d", kind);
+}
+
+#define TRAP(k) return (Trap) { .kind = (k), .program_counter = g_machine.program_counter, .opcode = opcode }
+#define TRAP_WHEN(x, k) if (__builtin_expect(x, 0)) TRAP(k)
+
+Trap machine_run_loop()
+{
+     uint16_t opcode = 0;
+     TRAP_WHEN(g_machine.program_counter + 2 > MACHINE_MEMORY_SIZE, TRAP_MEMORY_OUT_OF_BOUNDS);
+
+     opcode = g_machine.memory[g_machine.program_counter] << 8 | g_machine.memory[g_machine.program_counter+1];
      uint8_t x, y, height, pixel;
      bool key_pressed = false;
      bool flag = false;
@@ -55,12 +75,13 @@ void machine_run_loop()
                      break;
 
                  case 0x00EE: /*V 0x00EE: Return from subroutine */
+                     TRAP_WHEN(g_machine.stack_pointer == 0, TRAP_STACK_UNDERFLOW);
                      g_machine.stack_pointer--;
                      g_machine.program_counter = g_machine.stack[g_machine.stack_pointer];
                      break;
 
                  default:
-                     panic("Invalid instruction: %#04x", (int)opcode);
+                     TRAP(TRAP_INVALID_OPCODE);
                      break;
              }
              break;
@@ -70,9 +91,9 @@ void machine_run_loop()
              break;
 
         case 0x2000: /*V 0x2NNN: Call a subroutine at NNN */
+             TRAP_WHEN(g_machine.stack_pointer >= MACHINE_STACK_DEPTH, TRAP_STACK_OVERFLOW);
              g_machine.stack[g_machine.stack_pointer] = g_machine.program_counter;
              g_machine.stack_pointer++;
-             if (g_machine.stack_pointer > sizeof(g_machine.stack)) panic("Stack overflow.");
              g_machine.program_counter = (opcode & 0xFFF) - 2;
              break;
 
@@ -145,7 +166,7 @@ void machine_run_loop()
                       break;
 
                   default:
-                      panic("Invalid instruction: %#04x", (int)opcode);
+                      TRAP(TRAP_INVALID_OPCODE);
                       break;
               };
               break;
@@ -171,12 +192,14 @@ void machine_run_loop()
               y = g_machine.registers[(opcode & 0x00F0) >> 4] % 32;
               height = opcode & 0x000F;
 
+              TRAP_WHEN(g_machine.index_register + height > MACHINE_MEMORY_SIZE, TRAP_MEMORY_OUT_OF_BOUNDS);
               g_machine.registers[0xF] &= 0;
 
-              for (int yline = 0; yline < height; yline++) {
+              /* The start position wraps, the sprite itself is clipped at the screen edge */
+              for (int yline = 0; yline < height && y + yline < 32; yline++) {
                     pixel = g_machine.memory[g_machine.index_register + yline]; 
 
-                    for (int xline = 0; xline < 8; xline++) {
+                    for (int xline = 0; xline < 8 && x + xline < 64; xline++) {
                         if (!(pixel & (0x80 >> xline))) continue;
 
                         g_machine.registers[0xF] |= backend_flip_pixel(x + xline, y + yline);
@@ -187,15 +210,17 @@ void machine_run_loop()
         case 0xE000:
               switch (opcode & 0x00FF) {
                   case 0x009E: /* 0xEX9E: Skips the next instruction if the key stored in vX is pressed */
+                      TRAP_WHEN(g_machine.registers[(opcode & 0x0F00) >> 8] > KEY_F, TRAP_INVALID_KEY);
                       if (backend_is_pressed((Chip8Key)g_machine.registers[(opcode & 0x0F00) >> 8])) g_machine.program_counter += 2;
                       break;
 
                   case 0x00A1: /* 0xEXA1: Skips the next instruction if the key stored in vX isn't pressed */
+                      TRAP_WHEN(g_machine.registers[(opcode & 0x0F00) >> 8] > KEY_F, TRAP_INVALID_KEY);
                       if (!backend_is_pressed((Chip8Key)g_machine.registers[(opcode & 0x0F00) >> 8])) g_machine.program_counter += 2;
                       break;
 
                   default:
-                      panic("Invalid instruction: %#04x", (int)opcode);
+                      TRAP(TRAP_INVALID_OPCODE);
                       break;
               };
               break;
@@ -237,12 +262,14 @@ void machine_run_loop()
                       break;
 
                   case 0x0033: /* 0xFX33 - Store the Binary-coded decimal reprezentation of vX at addresses I, I+1, and I+3 */
+                      TRAP_WHEN(g_machine.index_register + 3 > MACHINE_MEMORY_SIZE, TRAP_MEMORY_OUT_OF_BOUNDS);
                       g_machine.memory[g_machine.index_register]   = g_machine.registers[(opcode & 0x0F00) >> 8] / 100;
                       g_machine.memory[g_machine.index_register+1] = (g_machine.registers[(opcode & 0x0F00) >> 8] / 10) % 10;
                       g_machine.memory[g_machine.index_register+2] = g_machine.registers[(opcode & 0x0F00) >> 8] % 10;
                       break;
 
                   case 0x0055: /* 0xFX55: Store value to vX in memory starting at address I */
+                      TRAP_WHEN(g_machine.index_register + ((opcode & 0x0F00) >> 8) + 1 > MACHINE_MEMORY_SIZE, TRAP_MEMORY_OUT_OF_BOUNDS);
                       for (int i=0; i <= ((opcode & 0x0F00) >> 8); i++) {
                           g_machine.memory[g_machine.index_register + i] = g_machine.registers[i];
                       }
@@ -251,6 +278,7 @@ void machine_run_loop()
                       break;
 
                   case 0x0065: /* 0xFX65: Load value to vX in memory starting at address I */
+                      TRAP_WHEN(g_machine.index_register + ((opcode & 0x0F00) >> 8) + 1 > MACHINE_MEMORY_SIZE, TRAP_MEMORY_OUT_OF_BOUNDS);
                       for (int i=0; i <= ((opcode & 0x0F00) >> 8); i++) {
                           g_machine.registers[i] = g_machine.memory[g_machine.index_register + i];
                       }
@@ -260,13 +288,13 @@ void machine_run_loop()
 
 
                   default:
-                      panic("Invalid instruction: %#04x", (int)opcode);
+                      TRAP(TRAP_INVALID_OPCODE);
                       break;
               };
               break;
 
         default:
-            panic("Invalid instruction: %#04x", (int)opcode);
+            TRAP(TRAP_INVALID_OPCODE);
             break;
      };
 
@@ -280,4 +308,9 @@ void machine_run_loop()
      } else {
         backend_toggle_beep(false);
      }
+
+     return (Trap) { .kind = TRAP_NONE, .program_counter = g_machine.program_counter, .opcode = opcode };
 }
+
+#undef TRAP_WHEN
+#undef TRAP
@@ -14,12 +14,31 @@
     - 16 8-bit (one byte) general-purpose variable registers numbered 0 through F hexadecimal, ie. 0 through 15 in decimal, called V0 through VF
 */
 
+#define MACHINE_MEMORY_SIZE 4096
+#define MACHINE_STACK_DEPTH 16
+
+typedef enum {
+    TRAP_NONE = 0,
+    TRAP_INVALID_OPCODE,
+    TRAP_INVALID_KEY,
+    TRAP_STACK_OVERFLOW,
+    TRAP_STACK_UNDERFLOW,
+    TRAP_MEMORY_OUT_OF_BOUNDS
+} TrapKind;
+
+/* Why the machine stopped, `program_counter` points at the faulting instruction */
+typedef struct {
+  TrapKind kind;
+  uint16_t program_counter;
+  uint16_t opcode;
+} Trap;
+
 typedef struct {
-  uint8_t  memory[4096];
+  uint8_t  memory[MACHINE_MEMORY_SIZE];
   uint8_t  screen[64 * 32 / 8];
   uint16_t program_counter;
   uint16_t index_register;
-  uint16_t stack[16];
+  uint16_t stack[MACHINE_STACK_DEPTH];
   uint8_t  stack_pointer;
   uint8_t  delay_timer;
   uint8_t  sound_timer;
@@ -29,4 +48,9 @@ typedef struct {
 extern Machine g_machine;
 
 void machine_load_rom(uint8_t* buffer);
-void machine_run_loop();
+/* Runs a single instruction. Faults in the ROM are returned as a trap instead of
+ * panicking, the machine state is left as it was before the faulting instruction.
+ * Every memory access starting at I traps as a whole if any of its bytes would
+ * land past the end of memory. */
+Trap machine_run_loop();
+const char* machine_trap_name(TrapKind kind);
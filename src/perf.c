@@ -0,0 +1,195 @@
+#include "perf.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL_timer.h>
+
+#include "panic.h"
+
+#define PERF_FRAME_SAMPLES 256
+#define PERF_WINDOW_NS 1000000000ull
+
+typedef struct {
+    uint64_t window_start;
+    uint64_t last_frame;
+
+    uint64_t section_start[PERF_SECTION_COUNT];
+    uint64_t section_total[PERF_SECTION_COUNT];
+
+    uint64_t instructions;
+    uint32_t frames;
+
+    uint32_t frame_times[PERF_FRAME_SAMPLES];
+    uint32_t frame_index;
+    uint32_t frame_count;
+
+    uint32_t latency[PERF_LATENCY_COUNT][PERF_LATENCY_BUCKETS];
+    uint32_t latency_count[PERF_LATENCY_COUNT];
+
+    PerfSnapshot snapshot;
+} Perf;
+
+Perf g_perf = { 0 };
+
+uint64_t perf_now()
+{
+    static uint64_t frequency = 0;
+    if (!frequency) frequency = SDL_GetPerformanceFrequency();
+
+    /* Split to keep counter * 1e9 from overflowing */
+    uint64_t counter = SDL_GetPerformanceCounter();
+    return counter / frequency * 1000000000ull + counter % frequency * 1000000000ull / frequency;
+}
+
+void perf_begin(PerfSection section)
+{
+    API_ABUSE_WHEN(section >= PERF_SECTION_COUNT);
+    g_perf.section_start[section] = perf_now();
+}
+
+void perf_end(PerfSection section)
+{
+    API_ABUSE_WHEN(section >= PERF_SECTION_COUNT);
+    g_perf.section_total[section] += perf_now() - g_perf.section_start[section];
+}
+
+void perf_count_instructions(uint32_t count)
+{
+    g_perf.instructions += count;
+}
+
+int perf_compare(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+double perf_percentile(const uint32_t* sorted, uint32_t count, uint32_t percent)
+{
+    if (count == 0) return 0;
+    return sorted[(count - 1) * percent / 100] / 1e6;
+}
+
+/* First millisecond of a bucket, the bucket ends where the next one starts */
+uint64_t perf_latency_bucket_start(int bucket)
+{
+    if (bucket < PERF_LATENCY_LINEAR_BUCKETS) return bucket;
+    return (uint64_t) PERF_LATENCY_LINEAR_BUCKETS << (bucket - PERF_LATENCY_LINEAR_BUCKETS);
+}
+
+void perf_record_latency(PerfLatency latency, uint64_t ns)
+{
+    API_ABUSE_WHEN(latency >= PERF_LATENCY_COUNT);
+
+    uint64_t ms = ns / 1000000;
+    int bucket = ms < PERF_LATENCY_LINEAR_BUCKETS ? (int) ms : PERF_LATENCY_LINEAR_BUCKETS;
+    while (bucket < PERF_LATENCY_BUCKETS - 1 && ms >= perf_latency_bucket_start(bucket + 1)) bucket++;
+
+    g_perf.latency[latency][bucket]++;
+    g_perf.latency_count[latency]++;
+}
+
+double perf_latency_percentile(PerfLatency latency, uint32_t percent)
+{
+    uint64_t target = ((uint64_t) g_perf.latency_count[latency] * percent + 99) / 100;
+    uint64_t seen = 0;
+
+    if (target == 0) return 0;
+
+    for (int i=0; i<PERF_LATENCY_BUCKETS - 1; i++) {
+        seen += g_perf.latency[latency][i];
+        if (seen >= target) return perf_latency_bucket_start(i + 1) - 1;
+    }
+
+    return perf_latency_bucket_start(PERF_LATENCY_BUCKETS - 1);
+}
+
+void perf_print_latency(FILE* stream)
+{
+    const char* names[PERF_LATENCY_COUNT] = { "input to observe", "input to photon" };
+
+    for (int i=0; i<PERF_LATENCY_COUNT; i++) {
+        uint32_t count = g_perf.latency_count[i];
+        uint32_t peak = 0;
+
+        if (count == 0) continue;
+
+        for (int j=0; j<PERF_LATENCY_BUCKETS; j++) if (g_perf.latency[i][j] > peak) peak = g_perf.latency[i][j];
+
+        double p50 = perf_latency_percentile(i, 50);
+        double p95 = perf_latency_percentile(i, 95);
+        fprintf(stream, "Latency, %s (%u samples, p50 %s%.0f ms, p95 %s%.0f ms):\n", names[i], count,
+                p50 >= PERF_LATENCY_OPEN_MS ? ">=" : "", p50, p95 >= PERF_LATENCY_OPEN_MS ? ">=" : "", p95);
+
+        for (int j=0; j<PERF_LATENCY_BUCKETS; j++) {
+            char range[32];
+            uint64_t start = perf_latency_bucket_start(j);
+
+            if (g_perf.latency[i][j] == 0) continue;
+
+            if (j == PERF_LATENCY_BUCKETS - 1)          snprintf(range, sizeof(range), ">=%llu", (unsigned long long) start);
+            else if (j < PERF_LATENCY_LINEAR_BUCKETS)   snprintf(range, sizeof(range), "%llu", (unsigned long long) start);
+            else                                        snprintf(range, sizeof(range), "%llu-%llu", (unsigned long long) start, (unsigned long long) perf_latency_bucket_start(j + 1) - 1);
+
+            int width = (int) (g_perf.latency[i][j] * 40ull / peak);
+            fprintf(stream, "  %12s ms %6u |%.*s\n", range, g_perf.latency[i][j], width > 0 ? width : 1, "########################################");
+        }
+    }
+}
+
+void perf_refresh_snapshot(uint64_t now)
+{
+    double elapsed = (double) (now - g_perf.window_start);
+    uint32_t sorted[PERF_FRAME_SAMPLES];
+
+    g_perf.snapshot.instructions_per_second = g_perf.instructions * 1e9 / elapsed;
+    g_perf.snapshot.frames_per_second = g_perf.frames * 1e9 / elapsed;
+
+    for (int i=0; i<PERF_SECTION_COUNT; i++) {
+        g_perf.snapshot.section_share[i] = g_perf.section_total[i] / elapsed;
+        g_perf.section_total[i] = 0;
+    }
+
+    memcpy(sorted, g_perf.frame_times, g_perf.frame_count * sizeof(uint32_t));
+    qsort(sorted, g_perf.frame_count, sizeof(uint32_t), perf_compare);
+
+    g_perf.snapshot.frame_p50 = perf_percentile(sorted, g_perf.frame_count, 50);
+    g_perf.snapshot.frame_p95 = perf_percentile(sorted, g_perf.frame_count, 95);
+    g_perf.snapshot.frame_p99 = perf_percentile(sorted, g_perf.frame_count, 99);
+
+    for (int i=0; i<PERF_LATENCY_COUNT; i++) {
+        g_perf.snapshot.latency_p50[i] = perf_latency_percentile(i, 50);
+        g_perf.snapshot.latency_p95[i] = perf_latency_percentile(i, 95);
+    }
+
+    g_perf.instructions = 0;
+    g_perf.frames = 0;
+    g_perf.window_start = now;
+}
+
+void perf_end_frame()
+{
+    uint64_t now = perf_now();
+
+    if (g_perf.last_frame == 0) {
+        g_perf.last_frame = now;
+        g_perf.window_start = now;
+        return;
+    }
+
+    uint64_t frame_time = now - g_perf.last_frame;
+    g_perf.frame_times[g_perf.frame_index] = frame_time > UINT32_MAX ? UINT32_MAX : (uint32_t) frame_time;
+    g_perf.frame_index = (g_perf.frame_index + 1) % PERF_FRAME_SAMPLES;
+    if (g_perf.frame_count < PERF_FRAME_SAMPLES) g_perf.frame_count++;
+
+    g_perf.frames++;
+    g_perf.last_frame = now;
+
+    if (now - g_perf.window_start >= PERF_WINDOW_NS) perf_refresh_snapshot(now);
+}
+
+const PerfSnapshot* perf_snapshot()
+{
+    return &g_perf.snapshot;
+}
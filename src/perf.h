@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum {
+    PERF_EMULATION = 0,
+    PERF_PRESENTATION,
+    PERF_SECTION_COUNT
+} PerfSection;
+
+/* Latency is measured from when the backend receives the key event from SDL.
+ * During the frame wait that is as soon as the key arrives, a key pressed while
+ * the instruction runs or the frame is presented is only received at the next
+ * poll, so that short slice is not counted. */
+typedef enum {
+    /* Key event until the program reads the key (EX9E/EXA1/FX0A) */
+    PERF_LATENCY_OBSERVE = 0,
+    /* Key event until the first frame presented after that read */
+    PERF_LATENCY_PHOTON,
+    PERF_LATENCY_COUNT
+} PerfLatency;
+
+/* 1ms per bucket below 64ms, then one bucket per doubling (64-127ms, 128-255ms, ...).
+ * The last bucket is open ended and holds everything slower. */
+#define PERF_LATENCY_LINEAR_BUCKETS 64
+#define PERF_LATENCY_BUCKETS (PERF_LATENCY_LINEAR_BUCKETS + 12)
+/* Where the open ended bucket starts. Closed buckets report their last millisecond,
+ * so only the open one reaches this and a percentile equal to it means "at least". */
+#define PERF_LATENCY_OPEN_MS ((uint64_t) PERF_LATENCY_LINEAR_BUCKETS << (PERF_LATENCY_BUCKETS - PERF_LATENCY_LINEAR_BUCKETS - 1))
+
+typedef struct {
+    double instructions_per_second;
+    double frames_per_second;
+    /* Frame time percentiles in milliseconds */
+    double frame_p50;
+    double frame_p95;
+    double frame_p99;
+    /* Share of wall time spent in each section, 0..1 */
+    double section_share[PERF_SECTION_COUNT];
+    /* Latency percentiles in milliseconds, over the whole run.
+     * Last millisecond of the bucket, or PERF_LATENCY_OPEN_MS if it landed in the open ended one. */
+    double latency_p50[PERF_LATENCY_COUNT];
+    double latency_p95[PERF_LATENCY_COUNT];
+} PerfSnapshot;
+
+/* Monotonic time in nanoseconds, from SDL's performance counter */
+uint64_t perf_now();
+
+void perf_begin(PerfSection section);
+void perf_end(PerfSection section);
+void perf_count_instructions(uint32_t count);
+/* Call once per presented frame, refreshes the snapshot about once a second */
+void perf_end_frame();
+
+void perf_record_latency(PerfLatency latency, uint64_t ns);
+/* Prints a histogram of every latency, nothing if no key press was ever observed */
+void perf_print_latency(FILE* stream);
+
+/* Will always return a non-null pointer */
+const PerfSnapshot* perf_snapshot();
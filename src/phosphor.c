@@ -0,0 +1,88 @@
+#include "phosphor.h"
+
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ Phosphor persistence:
+    XOR sprites are erased and redrawn every frame, so instead of showing the raw
+    framebuffer each pixel keeps an intensity that is set to full when the pixel is lit
+    and otherwise decays as i = max(i - i/4 - 1, 0). A pixel that blinks off for a frame
+    or two stays visible instead of flickering.
+
+    The pixel map stores 8 horizontal pixels per byte, least significant bit first,
+    so 16 pixels (two bytes) fit one 128-bit lane of intensities.
+*/
+
+static uint8_t g_intensity[PHOSPHOR_WIDTH * PHOSPHOR_HEIGHT] __attribute__((aligned(16)));
+
+void phosphor_reset()
+{
+    memset(g_intensity, 0, sizeof(g_intensity));
+}
+
+#ifdef __SSE2__
+
+void phosphor_update(const uint8_t* pixel_map, void* pixels, int pitch)
+{
+    const __m128i bits   = _mm_set_epi8(-128, 64, 32, 16, 8, 4, 2, 1, -128, 64, 32, 16, 8, 4, 2, 1);
+    const __m128i low6   = _mm_set1_epi8(0x3F);
+    const __m128i one    = _mm_set1_epi8(1);
+    const __m128i alpha  = _mm_set1_epi32((int) 0xFF000000);
+
+    for (int y=0; y<PHOSPHOR_HEIGHT; y++) {
+        __m128i* row = (__m128i*) ((uint8_t*) pixels + y*pitch);
+
+        for (int x=0; x<PHOSPHOR_WIDTH; x+=16) {
+            uint8_t* intensity = &g_intensity[y*PHOSPHOR_WIDTH + x];
+            const uint8_t* src = &pixel_map[(y*PHOSPHOR_WIDTH + x) / 8];
+
+            /* Broadcast both bytes over 8 lanes each, then test one bit per lane */
+            __m128i lit = _mm_cvtsi32_si128(src[0] | src[1] << 8);
+            lit = _mm_unpacklo_epi8(lit, lit);
+            lit = _mm_unpacklo_epi16(lit, lit);
+            lit = _mm_unpacklo_epi32(lit, lit);
+            lit = _mm_cmpeq_epi8(_mm_and_si128(lit, bits), bits);
+
+            /* SSE2 has no 8-bit shift, shift 16-bit lanes and mask off the borrowed bits */
+            __m128i value = _mm_load_si128((__m128i*) intensity);
+            __m128i quarter = _mm_and_si128(_mm_srli_epi16(value, 2), low6);
+            value = _mm_subs_epu8(_mm_sub_epi8(value, quarter), one);
+            value = _mm_max_epu8(value, lit);
+            _mm_store_si128((__m128i*) intensity, value);
+
+            /* Expand every intensity into a grey 0xFFvvvvvv pixel */
+            __m128i lo = _mm_unpacklo_epi8(value, value);
+            __m128i hi = _mm_unpackhi_epi8(value, value);
+            _mm_storeu_si128(row++, _mm_or_si128(_mm_unpacklo_epi16(lo, lo), alpha));
+            _mm_storeu_si128(row++, _mm_or_si128(_mm_unpackhi_epi16(lo, lo), alpha));
+            _mm_storeu_si128(row++, _mm_or_si128(_mm_unpacklo_epi16(hi, hi), alpha));
+            _mm_storeu_si128(row++, _mm_or_si128(_mm_unpackhi_epi16(hi, hi), alpha));
+        }
+    }
+}
+
+#else
+
+void phosphor_update(const uint8_t* pixel_map, void* pixels, int pitch)
+{
+    for (int y=0; y<PHOSPHOR_HEIGHT; y++) {
+        uint32_t* row = (uint32_t*) ((uint8_t*) pixels + y*pitch);
+
+        for (int x=0; x<PHOSPHOR_WIDTH; x++) {
+            uint8_t* intensity = &g_intensity[y*PHOSPHOR_WIDTH + x];
+            uint8_t value = *intensity - (*intensity >> 2);
+            value = value > 0 ? value - 1 : 0;
+
+            if (pixel_map[(y*PHOSPHOR_WIDTH + x) / 8] & (1 << (x%8))) value = 0xFF;
+
+            *intensity = value;
+            row[x] = 0xFF000000 | value * 0x010101;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+
+#define PHOSPHOR_WIDTH  64
+#define PHOSPHOR_HEIGHT 32
+
+/* Drops every pixel to zero intensity */
+void phosphor_reset();
+/* Decays the intensity buffer by one frame, relights every pixel set in the
+ * 1bpp pixel_map and expands the result into ARGB8888 rows `pitch` bytes apart */
+void phosphor_update(const uint8_t* pixel_map, void* pixels, int pitch);